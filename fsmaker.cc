@@ -37,12 +37,16 @@
  *   for development and testing purposes.
  */
 
+#include "tablefs_preload.h"
+
 #include <tablefs/tablefs_api.h>
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
 
 /*
  * helper/utility functions, included inline here so we are self-contained
@@ -93,6 +97,14 @@ static void mkfs(const char *fsloc) {
   tablefs_mkfile(fs, "/3/c", 0644);
 
   tablefs_closefs(fs);
+
+  /* subtree summaries saved by the preload lib no longer match */
+  char sumpath[PATH_MAX];
+  snprintf(sumpath, sizeof(sumpath), "%s/%s", fsloc,
+           TABLEFS_PRELOAD_SUMMARY_FNAME);
+  if (unlink(sumpath) == -1 && errno != ENOENT) {
+    ABORT("Cannot remove subtree summaries", strerror(errno));
+  }
 }
 
 /*
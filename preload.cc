@@ -34,7 +34,8 @@
 
 /*
  * preload.cc - redirect LANL GUFI/parallel_find fs ops to tablefs. Currently,
- * only lstat, opendir, readdir, and closedir functions are redirected, and
+ * only namespace functions (mkdir, rmdir, mknod, unlink, stat, lstat, access,
+ * opendir, readdir, closedir, and statvfs) are redirected, and
  * redirection is only triggered when the pathname passed to us starts with a
  * specific prefix (e.g., /tablefs). Code is ONLY TESTED ON LINUX PLATFORMS at
  * the moment. Does not work on macOS despite its POSIX compliance and
@@ -48,9 +49,13 @@
  *   DB home of tablefs. This is where tablefs stores namespace data.
  * PRELOAD_Tablefs_readonly
  *   Open tablefs as read only.
+ * PRELOAD_Tablefs_no_summary
+ *   Do not maintain subtree summaries.
  * PRELOAD_Verbose
  *   Print more information.
  */
+#include "tablefs_preload.h"
+
 #include <tablefs/tablefs_api.h>
 
 #include <assert.h>
@@ -64,6 +69,13 @@
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 /*
  * Error reporting facilities...
@@ -90,6 +102,7 @@ static struct next_functions {
   int (*closedir)(DIR* dirp);
   int (*access)(const char* path, int mode);
   int (*unlink)(const char* path);
+  int (*statvfs)(const char* path, struct statvfs* buf);
 } nxt = {0};
 
 /*
@@ -98,6 +111,7 @@ static struct next_functions {
  */
 static pthread_once_t preload_once = PTHREAD_ONCE_INIT;
 static pthread_once_t tablefs_once = PTHREAD_ONCE_INIT;
+static pthread_once_t summary_once = PTHREAD_ONCE_INIT;
 static void preload_init();
 static void tablefs_init();
 
@@ -106,6 +120,13 @@ static void tablefs_init();
  */
 static void closefs();
 
+/*
+ * subtree summary maintenance.
+ */
+static uint64_t summary_fingerprint();
+static void summary_load();
+static void summary_save();
+
 /*
  * helper functions...
  */
@@ -151,10 +172,47 @@ static struct preload_ctx {
   const char* path_prefix;
   const char* fsloc;
   tablefs_t* fs;
+  int nosummary;
   int rdonly;
   int v;
 } ctx = {0};
 
+/*
+ * subtree summaries: for each dir we keep aggregates covering everything
+ * beneath it so that statvfs and du-style queries are a single lookup instead
+ * of a namespace walk. Namespace ops do not touch the ancestor chain. They
+ * only add a delta to the parent dir's pending slot, so a batch of creates in
+ * the same dir collapses into one delta. Pending deltas are pushed up the
+ * ancestor chain when someone asks for a summary, or when fs is closed.
+ *
+ * tablefs does not let us store rows of our own, so summaries are kept in
+ * memory and saved to a file in tablefs home after fs is closed. The file
+ * records a fingerprint of the db files it was saved against. A file whose
+ * fingerprint does not match the db at open time (e.g., after a crash, or
+ * after fsmaker wrote to tablefs) is ignored and summaries are rebuilt by
+ * walking the namespace once. Only read-write runs save the file; read only
+ * runs never write to tablefs home.
+ */
+struct subtree {
+  subtree() : nents(0), nfiles(0), nbytes(0), mtime(0) {}
+  int64_t nents;
+  int64_t nfiles;
+  int64_t nbytes; /* always 0: no redirected op sets file sizes yet */
+  int64_t mtime;
+};
+
+typedef std::unordered_map<std::string, subtree> subtree_map;
+
+static struct summary_idx {
+  pthread_mutex_t mu;
+  subtree_map* sums;    /* propagated totals, by dir path */
+  subtree_map* pending; /* deltas not yet propagated, by parent dir path */
+  uint64_t fp;          /* fingerprint of db files before fs was opened */
+} sumidx = {PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0};
+
+#define SUMMARY_FNAME "/" TABLEFS_PRELOAD_SUMMARY_FNAME
+#define SUMMARY_MAGIC "tablefs-subtree-summary 3"
+
 /*
  * PRELOAD_Init: init preload lib or die.
  */
@@ -165,6 +223,17 @@ static void PRELOAD_Init() {
   }
 }
 
+/*
+ * SUMMARY_Init: load subtree summaries. Must be called after tablefs is
+ * opened.
+ */
+static void SUMMARY_Init() {
+  int rv = pthread_once(&summary_once, summary_load);
+  if (rv != 0) {
+    ABORT("pthread_once", strerror(rv));
+  }
+}
+
 /*
  * TABLEFS_Init: init tablefs.
  */
@@ -191,9 +260,11 @@ static void preload_init() {
   MUST_GETNEXTDLSYM(closedir);
   MUST_GETNEXTDLSYM(rmdir);
   MUST_GETNEXTDLSYM(mkdir);
+  MUST_GETNEXTDLSYM(statvfs);
 
 #undef MUST_GETNEXTDLSYM
   ctx.v = is_envset("PRELOAD_Verbose");
+  ctx.nosummary = is_envset("PRELOAD_Tablefs_no_summary");
   ctx.rdonly = is_envset("PRELOAD_Tablefs_readonly");
   ctx.fsloc = getenv("PRELOAD_Tablefs_home");
   if (!ctx.fsloc || !ctx.fsloc[0]) {
@@ -210,6 +281,7 @@ static void preload_init() {
   if (ctx.v) {
     printf("PRELOAD_Verbose=%d\n", ctx.v);
     printf("PRELOAD_Tablefs_readonly=%d\n", ctx.rdonly);
+    printf("PRELOAD_Tablefs_no_summary=%d\n", ctx.nosummary);
     printf("PRELOAD_Tablefs_path_prefix=%s\n", ctx.path_prefix);
     printf("PRELOAD_Tablefs_home=%s\n", ctx.fsloc);
   }
@@ -219,6 +291,7 @@ static void preload_init() {
 
 static void tablefs_init() {
   assert(!ctx.fs);
+  if (!ctx.nosummary) sumidx.fp = summary_fingerprint();
   ctx.fs = tablefs_newfshdl();
   if (ctx.rdonly) tablefs_set_readonly(ctx.fs, 1);
   int r = tablefs_openfs(ctx.fs, ctx.fsloc);
@@ -226,6 +299,10 @@ static void tablefs_init() {
     ABORT("tablefs_openfs", strerror(errno));
   } else {
     if (ctx.v) printf("== Fs opened!\n");
+    /* read only runs load summaries on first use; see summary_get() */
+    if (!ctx.nosummary && !ctx.rdonly) {
+      SUMMARY_Init();
+    }
     atexit(closefs);
   }
 }
@@ -233,6 +310,12 @@ static void tablefs_init() {
 static void closefs() {
   assert(ctx.fs);
   tablefs_closefs(ctx.fs);
+  ctx.fs = NULL;
+  /* saved after close so the fingerprint covers what close wrote. read only
+   * runs never write to tablefs home */
+  if (sumidx.sums && !ctx.rdonly) {
+    summary_save();
+  }
   if (ctx.v) printf("== Fs closed!\n");
   printf("Bye\n");
 }
@@ -255,6 +338,344 @@ static const char* is_tablefs(const char* input) {
   }
 }
 
+/*
+ * summary_key: return a tablefs path in the form summary_scan() builds: one
+ * '/' between components, no trailing '/', and "." and ".." resolved.
+ */
+static std::string summary_key(const char* path) {
+  std::string key;
+  const char* p = path;
+  while (*p) {
+    while (*p == '/') p++;
+    const char* end = p;
+    while (*end && *end != '/') end++;
+    size_t len = end - p;
+    if (len == 0 || (len == 1 && p[0] == '.')) {
+      /* skip */
+    } else if (len == 2 && p[0] == '.' && p[1] == '.') {
+      key.resize(key.empty() ? 0 : key.find_last_of('/'));
+    } else {
+      key.append(1, '/').append(p, len);
+    }
+    p = end;
+  }
+  return key.empty() ? "/" : key;
+}
+
+/*
+ * summary_parent: return the parent dir of a tablefs path.
+ */
+static std::string summary_parent(const std::string& path) {
+  size_t pos = path.find_last_of('/');
+  if (pos == 0 || pos == std::string::npos) {
+    return "/";
+  } else {
+    return path.substr(0, pos);
+  }
+}
+
+/*
+ * summary_update: record the creation (sign > 0) or the removal (sign < 0)
+ * of a file or dir at path. Only the parent dir's pending delta is touched.
+ */
+static void summary_update(const char* path, int isdir, int sign) {
+  pthread_mutex_lock(&sumidx.mu);
+  if (sumidx.sums) {
+    std::string key = summary_key(path);
+    if (isdir && sign > 0) {
+      /* a racing create beneath key may have been flushed already */
+      sumidx.sums->insert(subtree_map::value_type(key, subtree()));
+    } else if (isdir) {
+      /* deltas still pending for key, or racing in from ops that finished
+       * before the rmdir, go to its ancestors; see summary_flush() */
+      sumidx.sums->erase(key);
+    }
+    subtree& delta = (*sumidx.pending)[summary_parent(key)];
+    delta.nents += sign;
+    if (!isdir) delta.nfiles += sign;
+    delta.mtime = time(NULL);
+  }
+  pthread_mutex_unlock(&sumidx.mu);
+}
+
+/*
+ * summary_flush: push all pending deltas up the ancestor chain. Dirs without
+ * a summary (i.e., removed ones) are skipped, never recreated, so a delta
+ * that arrives after its dir was removed only reaches the ancestors that
+ * still count it. Caller must hold sumidx.mu.
+ */
+static void summary_flush() {
+  subtree_map::const_iterator it = sumidx.pending->begin();
+  for (; it != sumidx.pending->end(); ++it) {
+    const subtree& delta = it->second;
+    std::string dir = it->first;
+    for (;;) {
+      subtree_map::iterator sit = sumidx.sums->find(dir);
+      if (sit != sumidx.sums->end()) {
+        subtree& sum = sit->second;
+        sum.nents += delta.nents;
+        sum.nfiles += delta.nfiles;
+        sum.nbytes += delta.nbytes;
+        if (delta.mtime > sum.mtime) sum.mtime = delta.mtime;
+      }
+      if (dir == "/") break;
+      dir = summary_parent(dir);
+    }
+  }
+  sumidx.pending->clear();
+}
+
+/*
+ * summary_scan: rebuild summaries for dir and everything beneath it into
+ * sums by walking the namespace. Return the summary of dir.
+ */
+static subtree summary_scan(const std::string& dir, subtree_map* sums) {
+  std::vector<std::string> names;
+  tablefs_dir_t* d = tablefs_opendir(ctx.fs, dir.c_str());
+  if (d) {
+    struct dirent* ent;
+    while ((ent = tablefs_readdir(d))) {
+      if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+        continue;
+      names.push_back(ent->d_name);
+    }
+    /* close before descending so we hold at most one dir open */
+    tablefs_closedir(d);
+  }
+  const std::string prefix = dir == "/" ? dir : dir + "/";
+  subtree sum;
+  for (size_t i = 0; i < names.size(); i++) {
+    std::string child = prefix + names[i];
+    struct stat buf;
+    if (tablefs_lstat(ctx.fs, child.c_str(), &buf) != 0) {
+      continue;
+    }
+    if (S_ISDIR(buf.st_mode)) {
+      subtree sub = summary_scan(child, sums);
+      sum.nents += sub.nents;
+      sum.nfiles += sub.nfiles;
+      sum.nbytes += sub.nbytes;
+      if (sub.mtime > sum.mtime) sum.mtime = sub.mtime;
+    } else {
+      sum.nfiles++;
+    }
+    sum.nents++;
+    if (buf.st_mtime > sum.mtime) sum.mtime = buf.st_mtime;
+  }
+  (*sums)[dir] = sum;
+  return sum;
+}
+
+/*
+ * fnv1a: fold len bytes at p into hash h.
+ */
+static uint64_t fnv1a(uint64_t h, const void* p, size_t len) {
+  const unsigned char* c = static_cast<const unsigned char*>(p);
+  for (size_t i = 0; i < len; i++) {
+    h ^= c[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+/*
+ * summary_fingerprint: hash the names, sizes, and mtimes of the db files in
+ * tablefs home. Any write to tablefs changes at least one of them. Files
+ * rewritten by every db open (LOG, LOCK) and our own files are skipped.
+ */
+static uint64_t summary_fingerprint() {
+  std::vector<std::string> names;
+  DIR* d = nxt.opendir(ctx.fsloc);
+  if (d) {
+    struct dirent* ent;
+    while ((ent = nxt.readdir(d))) {
+      if (ent->d_name[0] == '.' || strncmp(ent->d_name, "LOG", 3) == 0 ||
+          strcmp(ent->d_name, "LOCK") == 0 ||
+          strncmp(ent->d_name, SUMMARY_FNAME + 1, strlen(SUMMARY_FNAME) - 1) ==
+              0)
+        continue;
+      names.push_back(ent->d_name);
+    }
+    nxt.closedir(d);
+  }
+  std::sort(names.begin(), names.end());
+  uint64_t h = 14695981039346656037ull;
+  for (size_t i = 0; i < names.size(); i++) {
+    std::string path = std::string(ctx.fsloc) + "/" + names[i];
+    struct stat buf;
+    if (stat(path.c_str(), &buf) != 0) {
+      continue;
+    }
+    char tmp[64];
+    int n = snprintf(tmp, sizeof(tmp), "%lld %lld %ld", (long long)buf.st_size,
+                     (long long)buf.st_mtim.tv_sec, buf.st_mtim.tv_nsec);
+    h = fnv1a(h, names[i].c_str(), names[i].size() + 1);
+    h = fnv1a(h, tmp, n + 1);
+  }
+  return h;
+}
+
+/*
+ * summary_read: read summaries saved by summary_save(). Return 1 on success,
+ * or 0 if the file is not usable or was saved against a different db state.
+ */
+static int summary_read(FILE* f, subtree_map* sums) {
+  char* line = NULL;
+  size_t cap = 0;
+  unsigned long long fp = 0;
+  unsigned long long nrows = 0;
+  unsigned long long rows = 0;
+  ssize_t n = getline(&line, &cap, f);
+  int ok = n > 0 &&
+           sscanf(line, SUMMARY_MAGIC " %llx %llu", &fp, &nrows) == 2 &&
+           fp == sumidx.fp;
+  while (ok && (n = getline(&line, &cap, f)) > 0) {
+    long long nents, nfiles, nbytes, mtime;
+    int off = 0;
+    if (line[n - 1] == '\n') line[n - 1] = 0;
+    int r = sscanf(line, "%lld %lld %lld %lld %n", &nents, &nfiles, &nbytes,
+                   &mtime, &off);
+    if (r != 4 || line[off] != '/') {
+      ok = 0;
+    } else {
+      subtree& sum = (*sums)[line + off];
+      sum.nents = nents;
+      sum.nfiles = nfiles;
+      sum.nbytes = nbytes;
+      sum.mtime = mtime;
+      rows++;
+    }
+  }
+  free(line);
+  /* a short or padded file is not trusted even if its header matches */
+  return ok && rows == nrows && rows == sums->size();
+}
+
+/*
+ * summary_load: called via SUMMARY_Init(). Load saved summaries from tablefs
+ * home, or rebuild them if none are usable. Loading and rebuilding are done
+ * without holding sumidx.mu, so namespace ops and statvfs calls that do not
+ * need summaries are not held up; the result is swapped in at the end.
+ */
+static void summary_load() {
+  std::string fname = std::string(ctx.fsloc) + SUMMARY_FNAME;
+  subtree_map* sums = new subtree_map;
+  int ok = 0;
+  FILE* f = fopen(fname.c_str(), "r");
+  if (f) {
+    ok = summary_read(f, sums);
+    fclose(f);
+  }
+  /* summary_flush() never creates entries, so root must be there */
+  if (ok && sums->find("/") == sums->end()) {
+    ok = 0;
+  }
+  if (!ok) {
+    sums->clear();
+    summary_scan("/", sums);
+  }
+  if (ctx.v) {
+    printf("== Subtree summaries %s (%zu dirs)\n", ok ? "loaded" : "rebuilt",
+           sums->size());
+  }
+  pthread_mutex_lock(&sumidx.mu);
+  assert(!sumidx.sums);
+  sumidx.pending = new subtree_map;
+  sumidx.sums = sums;
+  pthread_mutex_unlock(&sumidx.mu);
+}
+
+/*
+ * summary_save: flush and save summaries to tablefs home. The file is
+ * written under a unique temp name and then renamed into place, so readers
+ * never see a partial file.
+ */
+static void summary_save() {
+  std::string fname = std::string(ctx.fsloc) + SUMMARY_FNAME;
+  std::string tmpname = fname + ".XXXXXX";
+  pthread_mutex_lock(&sumidx.mu);
+  summary_flush();
+  uint64_t fp = summary_fingerprint();
+  FILE* f = NULL;
+  int fd = mkstemp(&tmpname[0]);
+  if (fd != -1) {
+    fchmod(fd, 0644);
+    f = fdopen(fd, "w");
+    if (!f) close(fd);
+  }
+  if (f) {
+    fprintf(f, "%s %016llx %llu\n", SUMMARY_MAGIC, (unsigned long long)fp,
+            (unsigned long long)sumidx.sums->size());
+    subtree_map::const_iterator it = sumidx.sums->begin();
+    for (; it != sumidx.sums->end(); ++it) {
+      const subtree& sum = it->second;
+      fprintf(f, "%lld %lld %lld %lld %s\n", (long long)sum.nents,
+              (long long)sum.nfiles, (long long)sum.nbytes,
+              (long long)sum.mtime, it->first.c_str());
+    }
+    int err = ferror(f);
+    if (fclose(f) != 0 || err ||
+        rename(tmpname.c_str(), fname.c_str()) != 0) {
+      f = NULL;
+    }
+  }
+  if (!f) {
+    fprintf(stderr, "== Cannot save subtree summaries: %s\n",
+            strerror(errno));
+    if (fd != -1) nxt.unlink(tmpname.c_str());
+  } else if (ctx.v) {
+    printf("== Subtree summaries saved (%zu dirs)\n", sumidx.sums->size());
+  }
+  pthread_mutex_unlock(&sumidx.mu);
+}
+
+/*
+ * summary_get: get the summary of the dir at path. Return 0 on success, or
+ * -1 with errno set on errors.
+ */
+static int summary_get(const char* path, subtree* result) {
+  int rv = 0;
+  SUMMARY_Init();
+  pthread_mutex_lock(&sumidx.mu);
+  summary_flush();
+  subtree_map::const_iterator it = sumidx.sums->find(summary_key(path));
+  if (it == sumidx.sums->end()) {
+    errno = ENOENT;
+    rv = -1;
+  } else {
+    /* a namespace op and its summary update are not atomic, so a dir may
+     * briefly see the removal of an entry before its creation */
+    *result = it->second;
+    if (result->nents < 0) result->nents = 0;
+    if (result->nfiles < 0) result->nfiles = 0;
+    if (result->nbytes < 0) result->nbytes = 0;
+  }
+  pthread_mutex_unlock(&sumidx.mu);
+  return rv;
+}
+
+/*
+ * fs_statvfs: report tablefs usage from the root summary. Free space and
+ * free inodes are those of the local fs holding tablefs home. tablefs files
+ * carry no data, so no blocks are reported as used.
+ */
+static int fs_statvfs(struct statvfs* buf) {
+  int rv = nxt.statvfs(ctx.fsloc, buf);
+  if (rv != 0) {
+    return rv;
+  }
+  subtree root;
+  if (!ctx.nosummary && summary_get("/", &root) != 0) {
+    return -1;
+  }
+  buf->f_blocks = buf->f_bavail;
+  buf->f_bfree = buf->f_bavail;
+  buf->f_files = root.nents + 1 + buf->f_favail; /* +1 for the root dir */
+  buf->f_ffree = buf->f_favail;
+  if (ctx.rdonly) buf->f_flag |= ST_RDONLY;
+  return 0;
+}
+
 /*
  * here are the actual override functions from libc.
  */
@@ -265,7 +686,9 @@ int rmdir(const char* path) {
   const char* newpath = is_tablefs(path);
   if (newpath) {
     TABLEFS_Init();
-    return tablefs_rmdir(ctx.fs, newpath);
+    int rv = tablefs_rmdir(ctx.fs, newpath);
+    if (rv == 0 && !ctx.nosummary) summary_update(newpath, 1, -1);
+    return rv;
   }
 
   return nxt.rmdir(path);
@@ -276,7 +699,9 @@ int mkdir(const char* path, mode_t mode) {
   const char* newpath = is_tablefs(path);
   if (newpath) {
     TABLEFS_Init();
-    return tablefs_mkdir(ctx.fs, newpath, mode);
+    int rv = tablefs_mkdir(ctx.fs, newpath, mode);
+    if (rv == 0 && !ctx.nosummary) summary_update(newpath, 1, 1);
+    return rv;
   }
 
   return nxt.mkdir(path, mode);
@@ -287,7 +712,9 @@ int __xmknod(int ver, const char* path, mode_t mode, dev_t* dev) {
   const char* newpath = is_tablefs(path);
   if (newpath) {
     TABLEFS_Init();
-    return tablefs_mkfile(ctx.fs, newpath, mode);
+    int rv = tablefs_mkfile(ctx.fs, newpath, mode);
+    if (rv == 0 && !ctx.nosummary) summary_update(newpath, 0, 1);
+    return rv;
   }
 
   return nxt.__xmknod(ver, path, mode, dev);
@@ -371,14 +798,45 @@ int unlink(const char* path) {
   const char* newpath = is_tablefs(path);
   if (newpath) {
     TABLEFS_Init();
-    return tablefs_unlink(ctx.fs, newpath);
+    int rv = tablefs_unlink(ctx.fs, newpath);
+    if (rv == 0 && !ctx.nosummary) summary_update(newpath, 0, -1);
+    return rv;
   }
 
   return nxt.unlink(path);
 }
 
 int statvfs(const char* path, struct statvfs* buf) {
-  memset(buf, 0, sizeof(struct statvfs));
+  PRELOAD_Init();
+  const char* newpath = is_tablefs(path);
+  if (newpath) {
+    TABLEFS_Init();
+    return fs_statvfs(buf);
+  }
+
+  return nxt.statvfs(path, buf);
+}
+
+int tablefs_preload_subtree(const char* path, struct tablefs_subtree_sum* sum) {
+  PRELOAD_Init();
+  const char* newpath = is_tablefs(path);
+  if (!newpath) {
+    errno = EINVAL;
+    return -1;
+  }
+  TABLEFS_Init();
+  if (ctx.nosummary) {
+    errno = ENOTSUP;
+    return -1;
+  }
+  subtree result;
+  if (summary_get(newpath, &result) != 0) {
+    return -1;
+  }
+  sum->nents = result.nents;
+  sum->nfiles = result.nfiles;
+  sum->nbytes = result.nbytes;
+  sum->mtime = result.mtime;
   return 0;
 }
 
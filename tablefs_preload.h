@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2019 Carnegie Mellon University,
+ * Copyright (c) 2019 Triad National Security, LLC, as operator of
+ *     Los Alamos National Laboratory.
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * with the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of CMU, TRIAD, Los Alamos National Laboratory, LANL, the
+ *    U.S. Government, nor the names of its contributors may be used to endorse
+ *    or promote products derived from this software without specific prior
+ *    written permission.
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * tablefs_preload.h - extension api exported by the tablefs preload lib.
+ *
+ * Programs running under LD_PRELOAD may look these functions up with
+ * dlsym(RTLD_DEFAULT, ...) so that they continue to work without the
+ * preload lib.
+ */
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * file in tablefs home where the preload lib saves subtree summaries. Tools
+ * that write to tablefs without the preload lib should remove it.
+ */
+#define TABLEFS_PRELOAD_SUMMARY_FNAME "SUBTREE-SUMMARY"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * tablefs_subtree_sum: aggregates covering everything beneath a directory.
+ * The directory itself is not counted. nbytes is always 0 for now: files
+ * are only created through mknod and no write path is redirected to
+ * tablefs, so every file is empty.
+ */
+struct tablefs_subtree_sum {
+  uint64_t nents;  /* number of files and dirs beneath the dir */
+  uint64_t nfiles; /* number of files beneath the dir */
+  uint64_t nbytes; /* total size of files beneath the dir; see above */
+  int64_t mtime;   /* time of the latest namespace change beneath the dir */
+};
+
+/*
+ * tablefs_preload_subtree: get the subtree summary of the dir at path. path
+ * must be under the preload path prefix. Return 0 on success, or -1 with
+ * errno set on errors.
+ */
+int tablefs_preload_subtree(const char* path, struct tablefs_subtree_sum* sum);
+
+#ifdef __cplusplus
+}
+#endif